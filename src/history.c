@@ -0,0 +1,458 @@
+/* -*- Mode: C; fill-column: 79 -*-
+ * Append-only, memory-mapped history of UPS samples.
+ * Copyright (C) 2019 Anil N <anilknyn@yahoo.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/* File layout: a file header padded to HIST_BLOCK_SIZE, followed by blocks of
+ * HIST_BLOCK_SIZE bytes each. A block carries its first sample in full in the
+ * block header, so every block decodes on its own and the first_time of the
+ * blocks forms a sorted index to binary search on.
+ *
+ * Every further sample in a block is one flags byte followed by varints:
+ *  - bit 0 set: the time step differs from the previous one, a zigzag varint
+ *    of (step - previous step) follows.
+ *  - bit (1 + i) set: field i changed, a zigzag varint of the difference
+ *    follows.
+ * A steady UPS polled at a steady interval costs a single byte per sample.
+ *
+ * Integers are stored in host byte order, the file is not meant to be moved
+ * between machines. */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "history.h"
+
+#define HIST_MAGIC         "WAPH"
+#define HIST_VERSION       1
+#define HIST_BLOCK_SIZE    512
+/* Blocks added to the file each time it runs full */
+#define HIST_GROW_BLOCKS   64
+/* Flags byte + time step + a value per field, 5 bytes per varint at most */
+#define HIST_SAMPLE_MAX    (1 + (1 + STAT_MAX) * 5)
+/* The flags byte has a bit for the time step and one per field */
+typedef char hist_flags_fit[(STAT_MAX <= 7) ? 1 : -1];
+
+typedef struct {
+    char     magic[4];
+    uint16_t version;
+    uint16_t block_size;
+    uint32_t num_fields;
+    uint32_t num_blocks;   /* Blocks in use, the last one may be partial */
+} HistoryFileHeader;
+
+typedef struct {
+    uint32_t first_time;   /* Unix time of the first sample */
+    uint32_t last_time;    /* Unix time of the last sample */
+    uint16_t count;        /* Samples in block, including the first */
+    uint16_t used;         /* Bytes of payload in use */
+    int32_t  first[STAT_MAX];
+} HistoryBlockHeader;
+
+#define HIST_PAYLOAD_SIZE  (HIST_BLOCK_SIZE - sizeof(HistoryBlockHeader))
+
+/* Walks the samples of one block */
+typedef struct {
+    const HistoryBlockHeader *b;
+    const uint8_t *p, *end;
+    unsigned int   left;
+    uint32_t       time, step;
+    int32_t        v[STAT_MAX];
+    int            corrupt;  /* Set when decoding stopped on bad data */
+} BlockCursor;
+
+/* Store being appended to */
+static int       hist_fd = -1;
+static uint8_t  *hist_map = NULL;
+static size_t    hist_map_size = 0;
+/* Last sample written, encoding state for the next one */
+static uint32_t  hist_last_time = 0;
+static uint32_t  hist_last_step = 0;
+static int32_t   hist_last[STAT_MAX];
+/* Set when the next sample must start a new block */
+static int       hist_fresh = 0;
+
+#define FILE_HEADER(map)     ((HistoryFileHeader *)(map))
+#define BLOCK(map, n)        ((HistoryBlockHeader *)((map) + (size_t)HIST_BLOCK_SIZE * (1 + (n))))
+#define BLOCK_PAYLOAD(b)     ((uint8_t *)(b) + sizeof(HistoryBlockHeader))
+#define FILE_SIZE(nblocks)   ((size_t)HIST_BLOCK_SIZE * (1 + (nblocks)))
+
+static uint32_t zigzag(int32_t v)
+{
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static int32_t unzigzag(uint32_t v)
+{
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+static int put_varint(uint8_t *p, uint32_t v)
+{
+    int n = 0;
+    while (v >= 0x80) {
+        p[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+/* Returns 0 on a truncated varint */
+static int get_varint(const uint8_t *p, const uint8_t *end, uint32_t *v)
+{
+    int n = 0, shift = 0;
+    *v = 0;
+    while ((p + n < end) && (shift < 35)) {
+        *v |= (uint32_t)(p[n] & 0x7f) << shift;
+        if ((p[n++] & 0x80) == 0)
+            return n;
+        shift += 7;
+    }
+    return 0;
+}
+
+/* Returns 0 if the block header can not be trusted */
+static int cursor_init(BlockCursor *c, const HistoryBlockHeader *b)
+{
+    if ((b->count == 0) || (b->used > HIST_PAYLOAD_SIZE)) {
+        fprintf(stderr, "history: corrupt block at time %u\n", b->first_time);
+        return 0;
+    }
+    c->b = b;
+    c->p = BLOCK_PAYLOAD(b);
+    c->end = c->p + b->used;
+    c->left = b->count;
+    c->time = b->first_time;
+    c->step = 0;
+    memcpy(c->v, b->first, sizeof(c->v));
+    c->corrupt = 0;
+    return 1;
+}
+
+/* Moves to the next sample (the first one on the first call). Returns 0 when
+ * the block is exhausted. */
+static int cursor_next(BlockCursor *c)
+{
+    uint8_t  flags;
+    uint32_t u;
+    int      i, n;
+
+    if (c->left == 0)
+        return 0;
+    if (c->left-- == c->b->count)
+        return 1;
+
+    if (c->p >= c->end)
+        goto Corrupt;
+    flags = *c->p++;
+
+    if (flags & 1) {
+        if (0 == (n = get_varint(c->p, c->end, &u)))
+            goto Corrupt;
+        c->p += n;
+        c->step += unzigzag(u);
+    }
+    c->time += c->step;
+
+    for (i=0; i<STAT_MAX; i++) {
+        if (flags & (1 << (1 + i))) {
+            if (0 == (n = get_varint(c->p, c->end, &u)))
+                goto Corrupt;
+            c->p += n;
+            c->v[i] += unzigzag(u);
+        }
+    }
+    return 1;
+
+Corrupt:
+    fprintf(stderr, "history: corrupt block at time %u\n", c->b->first_time);
+    c->left = 0;
+    c->corrupt = 1;
+    return 0;
+}
+
+/* 'num_blocks' is passed in, as h->num_blocks may change under a reader */
+static int header_valid(const HistoryFileHeader *h, uint32_t num_blocks, size_t size)
+{
+    return (0 == memcmp(h->magic, HIST_MAGIC, 4))
+        && (h->version == HIST_VERSION)
+        && (h->block_size == HIST_BLOCK_SIZE)
+        && (h->num_fields == STAT_MAX)
+        && (FILE_SIZE(num_blocks) <= size);
+}
+
+/* Start of the page holding block 'b', for msync() */
+static uint8_t *block_page(const HistoryBlockHeader *b)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return hist_map + ((((const uint8_t *)b) - hist_map) / page) * page;
+}
+
+/* Grows the file (and the mapping) to hold at least 'nblocks' blocks */
+static int reserve_blocks(uint32_t nblocks)
+{
+    size_t size = FILE_SIZE(nblocks + HIST_GROW_BLOCKS);
+    void *map;
+
+    if (FILE_SIZE(nblocks) <= hist_map_size)
+        return EXIT_SUCCESS;
+
+    if (ftruncate(hist_fd, size) == -1) {
+        perror("history: ftruncate");
+        return EXIT_FAILURE;
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, hist_fd, 0);
+    if (map == MAP_FAILED) {
+        perror("history: mmap");
+        return EXIT_FAILURE;
+    }
+    if (hist_map) munmap(hist_map, hist_map_size);
+    hist_map = map;
+    hist_map_size = size;
+    return EXIT_SUCCESS;
+}
+
+/** Opens (creating if needed) the history store at `path` for appending. */
+int history_open(const char *path)
+{
+    struct stat st;
+    HistoryFileHeader *h;
+
+    hist_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (hist_fd == -1) {
+        fprintf(stderr, "history: %s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    /* Appends from two processes would interleave in the same block */
+    if (flock(hist_fd, LOCK_EX | LOCK_NB) == -1) {
+        fprintf(stderr, "history: %s: %s\n", path,
+                (errno == EWOULDBLOCK) ? "in use by another wmapcups" : strerror(errno));
+        goto Error;
+    }
+    if (fstat(hist_fd, &st) == -1) {
+        perror("history: fstat");
+        goto Error;
+    }
+
+    if (st.st_size == 0) {
+        if (reserve_blocks(0) != EXIT_SUCCESS)
+            goto Error;
+        h = FILE_HEADER(hist_map);
+        memcpy(h->magic, HIST_MAGIC, 4);
+        h->version = HIST_VERSION;
+        h->block_size = HIST_BLOCK_SIZE;
+        h->num_fields = STAT_MAX;
+        h->num_blocks = 0;
+        return EXIT_SUCCESS;
+    }
+
+    hist_map_size = st.st_size;
+    hist_map = mmap(NULL, hist_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, hist_fd, 0);
+    if (hist_map == MAP_FAILED) {
+        perror("history: mmap");
+        hist_map = NULL;
+        goto Error;
+    }
+    h = FILE_HEADER(hist_map);
+    if ((hist_map_size < HIST_BLOCK_SIZE) || !header_valid(h, h->num_blocks, hist_map_size)) {
+        fprintf(stderr, "history: %s is not a history file (or a different version)\n", path);
+        goto Error;
+    }
+
+    /* Recover the encoding state from the last block */
+    if (h->num_blocks > 0) {
+        BlockCursor c;
+        int ok = cursor_init(&c, BLOCK(hist_map, h->num_blocks - 1));
+        if (ok) {
+            while (cursor_next(&c));
+            ok = !c.corrupt;
+        }
+        if (ok) {
+            hist_last_time = c.time;
+            hist_last_step = c.step;
+            memcpy(hist_last, c.v, sizeof(hist_last));
+        }
+        else {
+            /* Likely cut short by a crash, drop it and carry on in a new one */
+            fprintf(stderr, "history: %s: dropping damaged last block\n", path);
+            h->num_blocks --;
+            hist_last_time = (h->num_blocks > 0) ? BLOCK(hist_map, h->num_blocks - 1)->last_time : 0;
+            hist_fresh = 1;
+        }
+    }
+    return EXIT_SUCCESS;
+
+Error:
+    history_close();
+    return EXIT_FAILURE;
+}
+
+/** Appends the sample in `u` to the store opened with history_open(). Samples
+ *  not newer than the last one written are ignored. */
+void history_append(const UPSStatus *u)
+{
+    HistoryFileHeader  *h;
+    HistoryBlockHeader *b = NULL;
+    uint8_t  buf[HIST_SAMPLE_MAX];
+    uint32_t t = u->upd_time, step;
+    int      i, n = 1;
+
+    if (hist_map == NULL)
+        return;
+    h = FILE_HEADER(hist_map);
+    if ((h->num_blocks > 0) && (t <= hist_last_time))
+        return;
+
+    if ((h->num_blocks > 0) && !hist_fresh) {
+        b = BLOCK(hist_map, h->num_blocks - 1);
+
+        buf[0] = 0;
+        step = t - hist_last_time;
+        if (step != hist_last_step) {
+            buf[0] |= 1;
+            n += put_varint(buf + n, zigzag(step - hist_last_step));
+        }
+        for (i=0; i<STAT_MAX; i++) {
+            if (u->fields[i].i != hist_last[i]) {
+                buf[0] |= 1 << (1 + i);
+                n += put_varint(buf + n, zigzag(u->fields[i].i - hist_last[i]));
+            }
+        }
+
+        if (((size_t)b->used + n <= HIST_PAYLOAD_SIZE) && (b->count < UINT16_MAX)) {
+            memcpy(BLOCK_PAYLOAD(b) + b->used, buf, n);
+            b->used += n;
+            b->last_time = t;
+            b->count ++;
+            hist_last_step = step;
+            goto Done;
+        }
+    }
+
+    /* Start a new block with the sample in its header */
+    if (reserve_blocks(h->num_blocks + 1) != EXIT_SUCCESS)
+        return;
+    h = FILE_HEADER(hist_map);
+    b = BLOCK(hist_map, h->num_blocks);
+    b->first_time = b->last_time = t;
+    b->count = 1;
+    b->used = 0;
+    for (i=0; i<STAT_MAX; i++) b->first[i] = u->fields[i].i;
+    /* Block on disk before the header counts it, a crash in between must not
+     * leave an empty block in use */
+    msync(block_page(b), ((uint8_t *)b - block_page(b)) + HIST_BLOCK_SIZE, MS_SYNC);
+    h->num_blocks ++;
+    hist_last_step = 0;
+    hist_fresh = 0;
+
+Done:
+    hist_last_time = t;
+    for (i=0; i<STAT_MAX; i++) hist_last[i] = u->fields[i].i;
+}
+
+void history_close(void)
+{
+    if (hist_map) { munmap(hist_map, hist_map_size); hist_map = NULL; }
+    if (hist_fd != -1) { close(hist_fd); hist_fd = -1; }
+    hist_map_size = 0;
+    hist_fresh = 0;
+}
+
+/** Prints the samples in the store at `path` taken between `from` and `to`
+ *  (inclusive) to stdout, one per line. */
+int history_dump(const char *path, time_t from, time_t to)
+{
+    struct stat st;
+    const HistoryFileHeader *h;
+    uint8_t *map;
+    uint32_t lo, hi, n, num_blocks;
+    int fd, i, rc = EXIT_FAILURE;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "history: %s: %s\n", path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if ((fstat(fd, &st) == -1) || (st.st_size < HIST_BLOCK_SIZE)) {
+        fprintf(stderr, "history: %s is not a history file\n", path);
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("history: mmap");
+        return EXIT_FAILURE;
+    }
+    h = FILE_HEADER(map);
+    /* A running dockapp may append while we read, stick to what is mapped */
+    num_blocks = h->num_blocks;
+    if (!header_valid(h, num_blocks, st.st_size)) {
+        fprintf(stderr, "history: %s is not a history file (or a different version)\n", path);
+        goto Error;
+    }
+
+    /* Last block starting at or before 'from' */
+    lo = 0;
+    hi = num_blocks;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (BLOCK(map, mid)->first_time <= from)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    printf("# time\tlinev\tcharge\tcharging\tonline\tloadpct\ttimeleft\n");
+    for (n = lo; n < num_blocks; n++) {
+        const HistoryBlockHeader *b = BLOCK(map, n);
+        BlockCursor c;
+
+        if (b->first_time > to)
+            break;
+        if (b->last_time < from)
+            continue;
+
+        if (!cursor_init(&c, b))
+            continue;
+        while (cursor_next(&c)) {
+            if (c.time < from)
+                continue;
+            if (c.time > to)
+                break;
+            printf("%u", c.time);
+            for (i=0; i<STAT_MAX; i++) printf("\t%d", c.v[i]);
+            printf("\n");
+        }
+    }
+    rc = EXIT_SUCCESS;
+
+Error:
+    munmap(map, st.st_size);
+    return rc;
+}
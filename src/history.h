@@ -0,0 +1,32 @@
+/* -*- Mode: C; fill-column: 79 -*-
+ * Interface to history.c, the on-disk store of past UPS samples.
+ * Copyright (C) 2019 Anil N <anilknyn@yahoo.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef UPS_HISTORY_H
+#define UPS_HISTORY_H
+
+#include <time.h>
+
+#include "upsfetch.h"
+
+int   history_open(const char *path);
+void  history_append(const UPSStatus *u);
+void  history_close(void);
+int   history_dump(const char *path, time_t from, time_t to);
+
+#endif
@@ -31,6 +31,7 @@
 #include <X11/extensions/shape.h>
 
 #include "upsfetch.h"
+#include "history.h"
 #include "base.xpm"
 
 typedef struct Sprite {
@@ -40,30 +41,54 @@ typedef struct Sprite {
     int stride;  /* Value to increment rx to fetch next glyph in a 'font' set */
 } Sprite;
 
-/* % Charge, Big 3 digit */
-Sprite sprite_bcharge  = { 22,  8,  0,  64, 10, 18, 10 };
-/* Line Voltage, Small 3 digit */
-Sprite sprite_linev    = { 31, 29,  0,  83,  6,  9,  7 };
-/* Time left, Tiny 3 digit */
-Sprite sprite_timeleft = { 34, 47,  0, 119,  5,  7,  6 };
-/* Load Percent, Tiny 3 digit */
-Sprite sprite_loadpct  = {  8, 47,  0, 119,  5,  7,  6 };
-/* Online/Offline indicator - 2 state */
-Sprite sprite_online   = { 22, 30,  0, 108,  8,  9,  8 };
-/* Charging/Not-charging indicator - 2 state, Overlaid */
-Sprite sprite_charging = { 10, 18,  0,  93,  7, 12,  7 };
+/* Sprites of the elements in layout.def: sprite_linev, sprite_online, ... */
+#define LAYOUT_SPRITE(name, ups, field, x, y, rx, ry, w, h, stride) \
+    static const Sprite sprite_##name = { x, y, rx, ry, w, h, stride };
+#define LAYOUT_NUM      LAYOUT_SPRITE
+#define LAYOUT_STATE2   LAYOUT_SPRITE
+#define LAYOUT_BAR      LAYOUT_SPRITE
+#define LAYOUT_OVERLAY  LAYOUT_SPRITE
+#include "layout.def"
+#undef LAYOUT_NUM
+#undef LAYOUT_STATE2
+#undef LAYOUT_BAR
+#undef LAYOUT_OVERLAY
+#undef LAYOUT_SPRITE
+
 /* A full tile pixmap showing error msg */
-Sprite sprite_error    = {  0,  0, 64, 128, 64, 64, 64 };
-/* Battery bar */
-Sprite sprite_bar      = { 10, 13, 64,  96,  7, 23,  7 };
+static const Sprite sprite_error = {  0,  0, 64, 128, 64, 64, 64 };
 
 static const int PERIOD = 200;
 static const int SIZE = 64;
 static const int GLYPH_SPACE = 11;
 static const int GLYPH_HYPHEN = 10;
 
+/* Digit glyphs of every value a 3 digit sprite can show, right aligned and
+ * padded with GLYPH_SPACE. Filled once by build_digit_table(). */
+#define DIGITS_MAX        3
+#define DIGIT_TABLE_SIZE  1000
+static unsigned char digit_table[DIGIT_TABLE_SIZE][DIGITS_MAX];
+
+/* Fully rendered number strips and bar states, keyed by (Sprite, value), so
+ * that a value seen before costs one blit per frame. Least recently used
+ * entry is evicted when full. */
+#define STRIP_CACHE_MAX   32
+
+typedef struct StripCacheEntry {
+    const Sprite   *sp;       /* Sprite the strip was rendered for, NULL if unused */
+    int             value;    /* Value rendered into the strip */
+    int             w, h;     /* Strip dimensions */
+    unsigned long   last_use; /* Tick of last lookup, for LRU eviction */
+    DAShapedPixmap  strip;    /* Rendered pixmap and shape */
+} StripCacheEntry;
+
+typedef void (*StripPainter)(DAShapedPixmap *dst, const Sprite *sp, int value);
+
+static StripCacheEntry strip_cache[STRIP_CACHE_MAX];
+static unsigned long strip_cache_tick = 0;
+
 static DAShapedPixmap *back_pm = NULL, *all_pm = NULL;
-static Pixmap charge_mask = 0;
+static Pixmap overlay_mask = 0;
 
 static char  apc_nis_hostname_default[] = "127.0.0.1";
 static char *apc_nis_hostname = apc_nis_hostname_default;
@@ -71,6 +96,9 @@ static char  apc_wmname_prefix_default[] = "";
 static char *apc_wmname_prefix = apc_wmname_prefix_default;
 static int   apc_nis_portnum = 3551;
 static int   apc_nis_testonly = 0;
+static char *apc_history_file = NULL;
+static char *apc_history_dump_from = NULL;
+static char *apc_history_dump_to = NULL;
 
 static DAProgramOption DAPoptions[] = {
     {"-H", "--apc-nis-host", "Hostname for the APC UPS daemon running in NIS mode",
@@ -81,12 +109,88 @@ static DAProgramOption DAPoptions[] = {
      DONone, False, { NULL } },
     {NULL, "--window-name-prefix", "Prefix the window name with provided string (useful sometimes with -w option)",
      DOString, False, { .string = &apc_wmname_prefix } },
+    {NULL, "--history-file", "Record every successful poll in this history file",
+     DOString, False, { .string = &apc_history_file } },
+    {NULL, "--history-dump", "FROM TO: Print samples from the history file between the two times (Unix time or YYYY-MM-DD[ HH:MM[:SS]]) and exit",
+     DONone, False, { NULL } },
 };
 
+static void build_digit_table(void)
+{
+    int v, i;
+    for (v=0; v<DIGIT_TABLE_SIZE; v++) {
+        int rem = v;
+        for (i=DIGITS_MAX-1; i>=0; i--) {
+            digit_table[v][i] = ((rem != 0) || (i == DIGITS_MAX-1)) ? (rem % 10) : GLYPH_SPACE;
+            rem /= 10;
+        }
+    }
+}
+
+static void strip_cache_free_entry(StripCacheEntry *e)
+{
+    if (e->sp != NULL) {
+        XFreePixmap(DADisplay, e->strip.pixmap);
+        XFreePixmap(DADisplay, e->strip.shape);
+        e->sp = NULL;
+    }
+}
+
+static void strip_cache_clear(void)
+{
+    int i;
+    for (i=0; i<STRIP_CACHE_MAX; i++) strip_cache_free_entry(&strip_cache[i]);
+}
+
+/* Returns the strip showing 'value' for sprite 'sp', rendering it with
+ * 'paint' into a w x h pixmap on a miss. The strip is meant to be blitted to
+ * (sp->x, sp->y). */
+static DAShapedPixmap *strip_cache_get(const Sprite *sp, int value, int w, int h,
+                                       StripPainter paint)
+{
+    int i;
+    StripCacheEntry *e = &strip_cache[0];
+
+    strip_cache_tick ++;
+    for (i=0; i<STRIP_CACHE_MAX; i++) {
+        StripCacheEntry *c = &strip_cache[i];
+        if ((c->sp == sp) && (c->value == value)) {
+            c->last_use = strip_cache_tick;
+            return &c->strip;
+        }
+        /* Pick an unused slot, else the least recently used one */
+        if ((e->sp != NULL) && ((c->sp == NULL) || (c->last_use < e->last_use)))
+            e = c;
+    }
+
+    if ((e->sp == NULL) || (e->w != w) || (e->h != h)) {
+        strip_cache_free_entry(e);
+        e->strip = *back_pm; /* Shares GCs with the atlas */
+        e->strip.pixmap = XCreatePixmap(DADisplay, DAWindow, w, h, DADepth);
+        e->strip.shape = XCreatePixmap(DADisplay, DAWindow, w, h, 1);
+        e->w = w;
+        e->h = h;
+    }
+    e->sp = sp;
+    e->value = value;
+    e->last_use = strip_cache_tick;
+
+    /* DAGC may still carry the tile shape as clip mask, which is positioned
+     * for the tile and not for the strip. */
+    XSetClipMask(DADisplay, DAGC, None);
+    /* Start from the background the strip will cover */
+    DASPCopyArea(back_pm, &e->strip, sp->x, sp->y, w, h, 0, 0);
+    paint(&e->strip, sp, value);
+    XSetClipMask(DADisplay, DAGC, all_pm->shape);
+
+    return &e->strip;
+}
+
 static void setup(int ac, char *av[])
 {
     XGCValues gcv;
     unsigned long gcm;
+    build_digit_table();
     back_pm = DAMakeShapedPixmapFromData(base_xpm);
     if (!back_pm)
     {
@@ -94,9 +198,9 @@ static void setup(int ac, char *av[])
         exit(EXIT_FAILURE);
     }
 
-    /* Mask for Charge indicator. */
-    charge_mask = XCreatePixmap(DADisplay, DAWindow, SIZE, SIZE, 1);
-    XCopyPlane(DADisplay, back_pm->shape, charge_mask, back_pm->shapeGC, 64, 0, 64, 64, 0, 0, 1);
+    /* Mask shared by all overlays of layout.def (Charge indicator). */
+    overlay_mask = XCreatePixmap(DADisplay, DAWindow, SIZE, SIZE, 1);
+    XCopyPlane(DADisplay, back_pm->shape, overlay_mask, back_pm->shapeGC, 64, 0, 64, 64, 0, 0, 1);
 
     /* Target drawable */
     all_pm = DAMakeShapedPixmap();
@@ -107,9 +211,11 @@ static void setup(int ac, char *av[])
 
 static void cleanup(void)
 {
+    strip_cache_clear();
+    history_close();
     if (all_pm) { DAFreeShapedPixmap(all_pm); all_pm = NULL; }
     if (back_pm) { DAFreeShapedPixmap(back_pm); back_pm = NULL; }
-    if (charge_mask) { XFreePixmap(DADisplay, charge_mask); charge_mask = 0; }
+    if (overlay_mask) { XFreePixmap(DADisplay, overlay_mask); overlay_mask = 0; }
 }
 
 void clear_digits(int *digits, int num_digits)
@@ -120,7 +226,9 @@ void clear_digits(int *digits, int num_digits)
     }
 }
 
-/* Returns 1 if nothing usable was placed in digits buffer, 0 otherwise */
+/* Returns 1 if nothing usable was placed in digits buffer, 0 otherwise.
+ * Values up to DIGITS_MAX digits come from digit_table, so setup() must have
+ * run build_digit_table() first. */
 int to_digits(int val, int *sign, int *digits, int num_digits)
 {
     int i;
@@ -137,34 +245,42 @@ int to_digits(int val, int *sign, int *digits, int num_digits)
     }
     else
     {
-        char s_num[32] = "";
-        int s_num_n = snprintf(s_num, 32, "%d", abs_val);
-
         clear_digits(digits, num_digits);
 
-        if (s_num_n > num_digits)
+        if ((abs_val < DIGIT_TABLE_SIZE) && (num_digits <= DIGITS_MAX))
         {
-            return 0;
-        }
+            /* Too big to show, left blank */
+            if ((num_digits < DIGITS_MAX) &&
+                (digit_table[abs_val][DIGITS_MAX - num_digits - 1] != GLYPH_SPACE))
+            {
+                return 0;
+            }
 
-        for (i=0; i<s_num_n; i++) {
-            char v = s_num[i];
+            for (i=0; i<num_digits; i++) {
+                digits[num_digits - 1 - i] = digit_table[abs_val][DIGITS_MAX - 1 - i];
+            }
+        }
+        else
+        {
+            /* Past the table, a division per digit */
+            for (i=num_digits-1; i>=0; i--) {
+                digits[i] = abs_val % 10;
+                abs_val /= 10;
+                if (abs_val == 0) break;
+            }
 
-            if ((v >= '0') && (v <= '9'))
-            {
-                digits [num_digits - s_num_n + i] = v-'0';
-            } else if (v == '-')
+            /* Too big to show, left blank */
+            if (abs_val != 0)
             {
-                digits [num_digits - s_num_n + i] = 10;
+                clear_digits(digits, num_digits);
             }
         }
     }
     return 0;
 }
 
-/* Blits 3digit number (v) based on source (font) and destination indicated by
- * Sprite 'sp' */
-void show_num(int v, Sprite *sp)
+/* Paints the 3 digits of 'v' into a strip whose origin is at (sp->x, sp->y) */
+static void paint_num(DAShapedPixmap *dst, const Sprite *sp, int v)
 {
     int digits_size = 3;
     int digits[digits_size];
@@ -174,54 +290,89 @@ void show_num(int v, Sprite *sp)
     if (0 == to_digits(v, &sign, digits, digits_size)) {
         int i;
         for (i=0; i<digits_size; i++) {
-            DASPCopyArea(back_pm, all_pm,
+            DASPCopyArea(back_pm, dst,
                          (digits[i] * (sp->stride)) + sp->rx, sp->ry,
                          sp->w, sp->h,
-                         sp->x + (i* (sp->stride)), sp->y);
+                         i * (sp->stride), 0);
         }
     }
 }
 
-/* Toggles the online/offline sprite based on 'online' parameter */
-void show_linestatus(int online)
+/* Blits 3digit number (v) based on source (font) and destination indicated by
+ * Sprite 'sp' */
+static inline void show_num(int v, const Sprite *sp)
+{
+    int w = (2 * sp->stride) + sp->w;
+    DASPCopyArea(strip_cache_get(sp, v, w, sp->h, paint_num), all_pm,
+                 0, 0, w, sp->h, sp->x, sp->y);
+}
+
+/* Toggles a 2 state sprite based on 'on' parameter */
+static inline void show_state2(int on, const Sprite *sp)
 {
     DASPCopyArea(back_pm, all_pm,
-                 sprite_online.rx + ((online ? 1: 0) * sprite_online.w), sprite_online.ry,
-                 sprite_online.w, sprite_online.h,
-                 sprite_online.x, sprite_online.y);
+                 sp->rx + ((on != 0) * sp->w), sp->ry,
+                 sp->w, sp->h,
+                 sp->x, sp->y);
 }
 
-/* Overlays the battery motif with a lighting sprite if the UPS battery
- * is charging */
-int show_charging(int charging)
+/* Overlays the tile with a sprite (like the lightning on the battery motif
+ * when the UPS battery is charging) */
+static inline void show_overlay(int on, const Sprite *sp)
 {
-    if (charging) {
-        XSetClipMask(DADisplay, DAGC, charge_mask);
+    if (on) {
+        XSetClipMask(DADisplay, DAGC, overlay_mask);
         DASPCopyArea(back_pm, all_pm,
-                     sprite_charging.rx, sprite_charging.ry,
-                     sprite_charging.w, sprite_charging.h,
-                     sprite_charging.x, sprite_charging.y);
+                     sp->rx, sp->ry,
+                     sp->w, sp->h,
+                     sp->x, sp->y);
         XSetClipMask(DADisplay, DAGC, all_pm->shape);
     }
 }
 
-int show_charge_bar(int v)
+/* Paints the bar state for charge 'v' into a strip whose origin is at
+ * (sp->x, sp->y) */
+static void paint_charge_bar(DAShapedPixmap *dst, const Sprite *sp, int v)
 {
-    Sprite sprite = sprite_bar;
-    int offs = 4, height = sprite.h;
+    int offs = 4, height = sp->h;
 
     if ((v >= 0) && (v <= 100)) {
-        height = floor((sprite.h * v) / 100);
+        height = floor((sp->h * v) / 100);
         if (v > 60) offs = 0;
         else if (v > 40) offs = 1;
         else if (v > 20) offs = 2;
         else offs = 3;
     }
 
-    DASPCopyArea(back_pm, all_pm,
-                 sprite.rx + (offs * sprite.stride), sprite.ry,
-                 sprite.w, height,
-                 sprite.x, sprite.y + (sprite.h - height));
+    DASPCopyArea(back_pm, dst,
+                 sp->rx + (offs * sp->stride), sp->ry,
+                 sp->w, height,
+                 0, sp->h - height);
+}
+
+static inline void show_bar(int v, const Sprite *sp)
+{
+    /* Out of range values all look the same, share one strip */
+    if ((v < 0) || (v > 100)) v = -1;
+
+    DASPCopyArea(strip_cache_get(sp, v, sp->w, sp->h, paint_charge_bar), all_pm,
+                 0, 0, sp->w, sp->h, sp->x, sp->y);
+}
+
+/* Draws every element of layout.def from the statuses in 'u', indexed by the
+ * 'ups' column. Expands to one call per element with its sprite as a
+ * constant; 'blink' gates the overlays. */
+static void draw_layout(const UPSStatus u[], int blink)
+{
+#define LAYOUT_NUM(name, ups, field, ...)      show_num(u[ups].fields[field].i, &sprite_##name);
+#define LAYOUT_STATE2(name, ups, field, ...)   show_state2(u[ups].fields[field].i, &sprite_##name);
+#define LAYOUT_BAR(name, ups, field, ...)      show_bar(u[ups].fields[field].i, &sprite_##name);
+#define LAYOUT_OVERLAY(name, ups, field, ...)  show_overlay(u[ups].fields[field].i & blink, &sprite_##name);
+#include "layout.def"
+#undef LAYOUT_NUM
+#undef LAYOUT_STATE2
+#undef LAYOUT_BAR
+#undef LAYOUT_OVERLAY
 }
 
 /* Shows an error banner */
@@ -233,7 +384,19 @@ void show_error()
                  sprite_error.x, sprite_error.y);
 }
 
-#ifdef TEST_UI
+#ifndef TEST_UI
+/* Fetches the UPS status and records it in the history file, if one is open */
+static int poll_ups(void)
+{
+    int rc = get_status_from_apc_nis_server(apc_nis_hostname, apc_nis_portnum);
+    if ((rc == EXIT_SUCCESS)
+        && (EXPECTED_FIELDS == (ups.field_bitmap & EXPECTED_FIELDS)))
+    {
+        history_append(&ups);
+    }
+    return rc;
+}
+#else
 void test_ui()
 {
     static int test_val = 0;
@@ -241,23 +404,25 @@ void test_ui()
     static int test_blink_counter = 0;
     static int test_error = 0;
 
+    UPSStatus test_ups = {0};
+
     test_val += 3;
     test_val = test_val % 101;
 
-    show_num(test_val * 20, &sprite_linev);
-    show_num(test_val * 20, &sprite_timeleft);
-    show_num(test_val * 20, &sprite_loadpct);
-    show_num(test_val, &sprite_bcharge);
-
     test_blink_counter = test_blink_counter + 1;
     if (test_blink_counter > 10) {
         test_blink_counter = 0;
         test_blink ^= 1;
         test_error = test_error + 1;
     }
-    show_linestatus(test_blink);
-    show_charge_bar(test_val);
-    show_charging(test_blink);
+
+    test_ups.fields[STAT_LINEV].i = test_val * 20;
+    test_ups.fields[STAT_TIMELEFT].i = test_val * 20;
+    test_ups.fields[STAT_LOADPCT].i = test_val * 20;
+    test_ups.fields[STAT_CHARGE].i = test_val;
+    test_ups.fields[STAT_ONLINE].i = test_blink;
+    test_ups.fields[STAT_CHARGING].i = 1;
+    draw_layout(&test_ups, test_blink);
 
     if ((test_error % 4) == 0) {
         show_error();
@@ -270,18 +435,12 @@ void update_ui()
     static int test_blink_counter = 0;
     static int test_blink = 0;
 
-    show_num(ups.fields[STAT_LINEV].i, &sprite_linev);
-    show_num(ups.fields[STAT_TIMELEFT].i, &sprite_timeleft);
-    show_num(ups.fields[STAT_CHARGE].i, &sprite_bcharge);
-    show_num(ups.fields[STAT_LOADPCT].i, &sprite_loadpct);
-    show_linestatus(ups.fields[STAT_ONLINE].i);
-    show_charge_bar(ups.fields[STAT_CHARGE].i);
     test_blink_counter = test_blink_counter + 1;
     if (test_blink_counter > 10) {
         test_blink_counter = 0;
         test_blink ^= 1;
     }
-    show_charging(ups.fields[STAT_CHARGING].i & test_blink);
+    draw_layout(&ups, test_blink);
 }
 
 void update()
@@ -297,7 +456,7 @@ void update()
      * interval. */
     if (update_counter >= 75) {
         update_counter = 0;
-        get_status_from_apc_nis_server(apc_nis_hostname, apc_nis_portnum);
+        poll_ups();
     }
     update_counter ++;
 
@@ -313,6 +472,56 @@ void update()
     DASPSetPixmap(all_pm);
 }
 
+/* DAParseArguments takes a single value per option, so the two values of
+ * --history-dump are picked out of argv (along with the option) before it
+ * gets to see them. */
+static void take_history_dump_args(int *argc, char *argv[])
+{
+    int i;
+    for (i=1; i<*argc; i++) {
+        if (0 == strcmp(argv[i], "--history-dump")) {
+            if (i + 2 >= *argc) {
+                fprintf(stderr, "ERR: --history-dump needs FROM and TO\n");
+                exit(EXIT_FAILURE);
+            }
+            apc_history_dump_from = argv[i+1];
+            apc_history_dump_to = argv[i+2];
+            /* Includes the terminating NULL */
+            memmove(&argv[i], &argv[i+3], (*argc - i - 2) * sizeof(char *));
+            *argc -= 3;
+            return;
+        }
+    }
+}
+
+/* Accepts Unix time or local time as YYYY-MM-DD[ HH:MM[:SS]] */
+static int parse_time(const char *s, time_t *t)
+{
+    struct tm tm;
+    char *e = NULL;
+    int n, end_date = -1, end_min = -1, end_sec = -1, end = -1;
+
+    memset(&tm, 0, sizeof(tm));
+    n = sscanf(s, "%d-%d-%d%n%*[ T]%d:%d%n:%d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &end_date, &tm.tm_hour, &tm.tm_min, &end_min, &tm.tm_sec, &end_sec);
+    if (n == 3) end = end_date;
+    else if (n == 5) end = end_min;
+    else if (n == 6) end = end_sec;
+
+    if (n >= 3) {
+        if ((end == -1) || (s[end] != 0))
+            return EXIT_FAILURE;
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+        tm.tm_isdst = -1;
+        *t = mktime(&tm);
+        return (*t == (time_t)-1) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    *t = strtol(s, &e, 10);
+    return ((e == s) || (*e != 0)) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 int main(int argc, char *argv[])
 {
     int rc = EXIT_FAILURE;
@@ -328,6 +537,7 @@ int main(int argc, char *argv[])
         update,
     };
 
+    take_history_dump_args(&argc, argv);
     DAParseArguments(argc, argv, DAPoptions,
                      sizeof(DAPoptions)/sizeof(DAProgramOption),
                      "Windowmanager dockapp showing APC UPS status\n"
@@ -339,8 +549,32 @@ int main(int argc, char *argv[])
     if (DAPoptions[3].used)
         snprintf(window_name, _WM_NAME_MAX, "%s%s", apc_wmname_prefix, PACKAGE_NAME);
 
+    if (apc_history_dump_from != NULL)
+    {
+        time_t from, to;
+        if (apc_history_file == NULL)
+        {
+            fprintf(stderr, "ERR: --history-dump needs --history-file\n");
+            return EXIT_FAILURE;
+        }
+        if ((parse_time(apc_history_dump_from, &from) != EXIT_SUCCESS)
+            || (parse_time(apc_history_dump_to, &to) != EXIT_SUCCESS))
+        {
+            fprintf(stderr, "ERR: Could not parse time range '%s' '%s'\n",
+                    apc_history_dump_from, apc_history_dump_to);
+            return EXIT_FAILURE;
+        }
+        return history_dump(apc_history_file, from, to);
+    }
+
 #ifndef TEST_UI
-    rc = get_status_from_apc_nis_server(apc_nis_hostname, apc_nis_portnum);
+    if ((apc_history_file != NULL) && !apc_nis_testonly)
+    {
+        if (history_open(apc_history_file) != EXIT_SUCCESS)
+            fprintf(stderr, "WARN: Not recording history\n");
+    }
+
+    rc = poll_ups();
     if (apc_nis_testonly)
     {
         if (rc != EXIT_FAILURE)